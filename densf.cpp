@@ -3,17 +3,30 @@
 // Author: Nathan Misner
 // I place this file in the public domain.
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <format>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "sfarchive.h"
+#include "sfio.h"
 
 #define NUM_PIPES 10
 #define PACKET_LEN 288
 #define PACKET_DATA_LEN 246
+#define MAX_FILE_LEN (4 * 1024 * 1024)
+#define MAX_FILE_PACKETS (MAX_FILE_LEN / PACKET_DATA_LEN)
+#define SUPERFRAME_LEN (PACKET_LEN * NUM_PIPES)
 
 uint8_t pipes[NUM_PIPES][PACKET_LEN];
 
@@ -22,11 +35,31 @@ uint8_t pipes[NUM_PIPES][PACKET_LEN];
 typedef struct {
     int base;
     int len;
-    uint8_t data[4 * 1024 * 1024];
+    uint16_t fileId;
+    uint8_t serviceId;
+    // one bit per packet address (relative to base) that's been decoded
+    uint8_t received[(MAX_FILE_PACKETS + 7) / 8];
+    // set if a packet had to be thrown out, so the file can't be complete
+    bool dropped;
+    // MAX_FILE_LEN bytes, never freed because this is a one-shot program.
+    // not used when demuxing by service.
+    uint8_t *data;
 } GameFile;
-GameFile newFile;
 
-std::map<uint16_t, GameFile> gameFiles;
+// different services can use the same file id, so files are keyed by both
+std::map<uint32_t, GameFile> gameFiles;
+
+static inline uint32_t GameFileKey(uint16_t fileId, uint8_t serviceId) {
+    return ((uint32_t)fileId << 8) | serviceId;
+}
+
+// a file that's ready to be written to disk
+typedef struct {
+    uint16_t fileId;
+    uint8_t serviceId;
+    uint8_t *data;
+    int len;
+} OutFile;
 
 static const uint8_t reverseByteLut[] = {
     0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
@@ -215,86 +248,960 @@ void GetData(uint8_t *in, uint8_t *out) {
     }
 }
 
-int main(int argc, char **argv) {
-    if (argc < 3) {
-        printf("use: densf file.img outdir");
+// Each data block is followed by a 16 bit BCH code (stored MSB first) and a
+// parity bit over the block's data bits. The first block's code also covers
+// the packet header, starting at bit 28. Same codes as nsf's CalcBCH and
+// CalcParity.
+static inline int PacketBit(const uint8_t *in, unsigned bit) {
+    bit--;
+    return (in[bit >> 3] >> (bit & 7)) & 1;
+}
+
+// checks every data block of a deinterleaved packet against its BCH code and
+// parity bit
+bool DataValid(const uint8_t *in) {
+    unsigned bitoff = 140;
+    for (int i = 0; i < PACKET_DATA_LEN;) {
+        if (bitoff == 1153) {
+            bitoff += 27;
+        }
+
+        unsigned numBits = (i == 0) ? 96 : 208;
+        uint16_t bch = 0;
+        for (unsigned bit = (i == 0) ? 28 : bitoff; bit < (bitoff + numBits); bit++) {
+            if ((bch >> 15) ^ PacketBit(in, bit)) {
+                bch = ((bch ^ 0x37b1) << 1) | 1;
+            }
+            else {
+                bch <<= 1;
+            }
+        }
+        int parity = 0;
+        for (unsigned bit = bitoff; bit < (bitoff + numBits); bit++) {
+            parity ^= PacketBit(in, bit);
+        }
+        bitoff += numBits;
+
+        uint16_t stored = 0;
+        for (unsigned j = 0; j < 16; j++) {
+            stored = (stored << 1) | PacketBit(in, bitoff + j);
+        }
+        if ((stored != bch) || (PacketBit(in, bitoff + 16) != parity)) {
+            return false;
+        }
+        bitoff += 17;
+        i += numBits / 8;
+    }
+    return true;
+}
+
+// --- sync search ---
+// Each packet header (bits 28-83, before interleaving) ends with a CRC of the
+// rest of the header, and the whole header is repeated in bits 84-139. A
+// superframe is considered in sync if enough of its pipes have a header that
+// matches its copy and passes the CRC check.
+#define HEADER_START 27
+#define HEADER_CRC_START 67
+#define HEADER_LEN 56
+// minimum number of pipes with a good header to call a superframe in sync
+#define SYNC_MIN_PIPES 5
+
+#define HEADER_CRC_BITS (HEADER_CRC_START - HEADER_START)
+
+// superframe byte offset (for pipe 0) and bit number of each bit of the header
+// and its copy, in deinterleaved order
+unsigned headerByteOff[HEADER_LEN * 2];
+uint8_t headerShift[HEADER_LEN * 2];
+
+// the search checks the first SCAN_CRC_BITS bits of the stored CRC. the CRC is
+// linear, so each of its bits is just the parity of some of the header bits
+// (the ones listed here) plus a constant.
+#define SCAN_CRC_BITS 2
+uint8_t crcTaps[SCAN_CRC_BITS][HEADER_CRC_BITS];
+int numCrcTaps[SCAN_CRC_BITS];
+uint8_t crcConst[SCAN_CRC_BITS];
+
+// same CRC as nsf's CalcCRC
+uint16_t HeaderCrc(const uint8_t *bits, int numBits) {
+    uint16_t crc = 0;
+    for (int i = 0; i < numBits; i++) {
+        if (((crc >> 15) ^ bits[i]) & 1) {
+            crc = ((crc ^ 0x810) << 1) | 1;
+        }
+        else {
+            crc <<= 1;
+        }
+    }
+    return ~crc;
+}
+
+// works out where DeInterLeave pulls each header bit from by feeding it one bit
+// at a time, and which header bits feed into each CRC bit the search checks
+void BuildSyncTables() {
+    uint8_t test[PACKET_LEN];
+    int found = 0;
+
+    for (unsigned src = 0; src < (PACKET_LEN * 8); src++) {
+        memset(test, 0, sizeof(test));
+        test[src >> 3] = 1 << (src & 7);
+        DeInterLeave(test);
+        for (unsigned dst = HEADER_START; dst < (HEADER_START + (HEADER_LEN * 2)); dst++) {
+            if (test[dst >> 3] & (1 << (dst & 7))) {
+                unsigned pipeByte = src >> 3;
+                headerByteOff[dst - HEADER_START] = ((pipeByte >> 1) * (NUM_PIPES * 2)) + (pipeByte & 1);
+                headerShift[dst - HEADER_START] = src & 7;
+                found++;
+            }
+        }
+    }
+    if (found != (HEADER_LEN * 2)) { abort(); }
+
+    uint8_t bits[HEADER_CRC_BITS] = { 0 };
+    uint16_t zeroCrc = HeaderCrc(bits, HEADER_CRC_BITS);
+    for (int i = 0; i < SCAN_CRC_BITS; i++) {
+        // the stored CRC is most significant bit first
+        crcConst[i] = (zeroCrc >> (15 - i)) & 1;
+    }
+    for (int k = 0; k < HEADER_CRC_BITS; k++) {
+        bits[k] = 1;
+        uint16_t tapCrc = HeaderCrc(bits, HEADER_CRC_BITS) ^ zeroCrc;
+        bits[k] = 0;
+        for (int i = 0; i < SCAN_CRC_BITS; i++) {
+            if ((tapCrc >> (15 - i)) & 1) {
+                crcTaps[i][numCrcTaps[i]++] = k;
+            }
+        }
+    }
+}
+
+bool HeaderValid(const uint8_t *superframe, int pipe) {
+    const uint8_t *sf = superframe + (pipe * 2);
+    uint8_t bits[HEADER_LEN];
+
+    // comparing against the copy first throws out most garbage within a few bits
+    for (int i = 0; i < HEADER_LEN; i++) {
+        bits[i] = (sf[headerByteOff[i]] >> headerShift[i]) & 1;
+        if (bits[i] != ((sf[headerByteOff[i + HEADER_LEN]] >> headerShift[i + HEADER_LEN]) & 1)) {
+            return false;
+        }
+    }
+
+    uint16_t stored = 0;
+    for (int i = 0; i < 16; i++) {
+        stored = (stored << 1) | bits[HEADER_CRC_BITS + i];
+    }
+    return HeaderCrc(bits, HEADER_CRC_BITS) == stored;
+}
+
+// returns the number of pipes with a good header, and sets a bit in goodPipes
+// for each one. gives up early once the superframe can't be in sync.
+int CheckSuperframe(const uint8_t *superframe, unsigned *goodPipes) {
+    int good = 0;
+    *goodPipes = 0;
+    for (int i = 0; i < NUM_PIPES; i++) {
+        if (HeaderValid(superframe, i)) {
+            *goodPipes |= (1 << i);
+            good++;
+        }
+        else if ((i + 1 - good) > (NUM_PIPES - SYNC_MIN_PIPES)) {
+            return 0;
+        }
+    }
+    return good;
+}
+
+// the search does a cheap version of HeaderValid (SCAN_BITS bits against the
+// copy, plus SCAN_CRC_BITS bits of the CRC) for a block of consecutive
+// candidate offsets at once. a header bit for consecutive offsets is in
+// consecutive bytes, so the inner loops are plain byte-wise operations over a
+// fixed number of lanes that the compiler turns into SIMD.
+#define SCAN_LANES 32
+#define SCAN_BITS 8
+
+// returns the first of the next count offsets that might be the start of a
+// superframe in sync, or count if none of them can be
+size_t ScanForSync(const uint8_t *buf, size_t count) {
+    size_t base;
+    for (base = 0; (base + SCAN_LANES) <= count; base += SCAN_LANES) {
+        uint8_t pass[SCAN_LANES] = { 0 };
+        for (int pipe = 0; pipe < NUM_PIPES; pipe++) {
+            const uint8_t *sf = buf + base + (pipe * 2);
+            uint8_t diff[SCAN_LANES] = { 0 };
+            for (int i = 0; i < SCAN_BITS; i++) {
+                const uint8_t *a = sf + headerByteOff[i];
+                const uint8_t *b = sf + headerByteOff[i + HEADER_LEN];
+                uint8_t shiftA = headerShift[i];
+                uint8_t shiftB = headerShift[i + HEADER_LEN];
+                for (int lane = 0; lane < SCAN_LANES; lane++) {
+                    diff[lane] |= (a[lane] >> shiftA) ^ (b[lane] >> shiftB);
+                }
+            }
+            // most garbage is already out by now, skip the CRC if it all is
+            uint8_t alive = 0;
+            for (int lane = 0; lane < SCAN_LANES; lane++) {
+                alive |= ~diff[lane] & 1;
+            }
+            if (alive) {
+                for (int i = 0; i < SCAN_CRC_BITS; i++) {
+                    const uint8_t *stored = sf + headerByteOff[HEADER_CRC_BITS + i];
+                    uint8_t shift = headerShift[HEADER_CRC_BITS + i];
+                    uint8_t parity[SCAN_LANES];
+                    for (int lane = 0; lane < SCAN_LANES; lane++) {
+                        parity[lane] = crcConst[i] ^ (stored[lane] >> shift);
+                    }
+                    for (int j = 0; j < numCrcTaps[i]; j++) {
+                        int tap = crcTaps[i][j];
+                        const uint8_t *bit = sf + headerByteOff[tap];
+                        uint8_t tapShift = headerShift[tap];
+                        for (int lane = 0; lane < SCAN_LANES; lane++) {
+                            parity[lane] ^= bit[lane] >> tapShift;
+                        }
+                    }
+                    for (int lane = 0; lane < SCAN_LANES; lane++) {
+                        diff[lane] |= parity[lane];
+                    }
+                }
+            }
+
+            uint8_t maxPass = 0;
+            for (int lane = 0; lane < SCAN_LANES; lane++) {
+                pass[lane] += !(diff[lane] & 1);
+                maxPass = (pass[lane] > maxPass) ? pass[lane] : maxPass;
+            }
+            // stop once no offset in the block can get enough good pipes
+            if ((maxPass + (NUM_PIPES - 1 - pipe)) < SYNC_MIN_PIPES) { break; }
+        }
+        for (int lane = 0; lane < SCAN_LANES; lane++) {
+            if (pass[lane] >= SYNC_MIN_PIPES) {
+                return base + lane;
+            }
+        }
+    }
+    // leave the last few for the full check
+    return base;
+}
+
+// shifting a superframe by 2 bytes moves every pipe over by one, so one that's
+// read a few pipes early or late still has good headers in the pipes that line
+// up. this is the furthest off it can be and still look in sync.
+#define MAX_SLIP ((NUM_PIPES - SYNC_MIN_PIPES) * 2)
+
+// sliding window over the input so the search can step one byte at a time
+#define WINDOW_LEN (SUPERFRAME_LEN * 16)
+typedef struct {
+    SfReader *reader;
+    uint8_t buf[WINDOW_LEN];
+    size_t start;
+    size_t end;
+    // file offset of buf[start]
+    uint64_t pos;
+} SyncWindow;
+
+// returns the number of bytes available from the window start, topping the
+// window up from the file if there's not enough left to check for a slip.
+// the MAX_SLIP bytes before the start are kept around too.
+size_t FillWindow(SyncWindow *w) {
+    if ((w->end - w->start) < (SUPERFRAME_LEN + MAX_SLIP)) {
+        size_t keep = (w->start < MAX_SLIP) ? w->start : MAX_SLIP;
+        memmove(w->buf, w->buf + w->start - keep, w->end - w->start + keep);
+        w->end -= (w->start - keep);
+        w->start = keep;
+        w->end += SfRead(w->reader, w->buf + w->end, WINDOW_LEN - w->end);
+    }
+    return w->end - w->start;
+}
+
+void Skip(SyncWindow *w, int64_t len) {
+    w->start += len;
+    w->pos += len;
+}
+
+// looks at the superframes a whole number of pipes around the window start
+// (only after it unless allowBack is set) and moves the window to whichever one
+// has the most good headers. returns how far the window moved.
+int AlignSuperframe(SyncWindow *w, bool allowBack, unsigned *goodPipes, int good) {
+    int best = 0;
+    for (int slip = allowBack ? -MAX_SLIP : 2; slip <= MAX_SLIP; slip += 2) {
+        if (!slip || ((slip < 0) && ((size_t)-slip > w->start)) ||
+            ((w->start + slip + SUPERFRAME_LEN) > w->end)) {
+            continue;
+        }
+        unsigned slipPipes;
+        int slipGood = CheckSuperframe(w->buf + w->start + slip, &slipPipes);
+        if (slipGood > good) {
+            best = slip;
+            good = slipGood;
+            *goodPipes = slipPipes;
+        }
+    }
+    Skip(w, best);
+    return best;
+}
+
+// --- per-service demux ---
+// With --by-service, each service gets its own output directory
+// (out/<serviceId>/<fileId>.sa) and its own writer thread. The decoder hands
+// packets to the service's queue as they come in, and the writer puts them
+// straight into place in the file, so nothing has to be held in memory until
+// the end. The writer sorts each batch it takes off the queue by file and
+// offset, so runs of consecutive packets go out in one write.
+#define NUM_SERVICES 128
+// packets a service's queue can hold before the decoder has to wait for it
+#define SINK_QUEUE_LEN 4096
+// files each writer keeps open at once, the least recently written one is
+// closed to make room for another
+#define SINK_MAX_OPEN 64
+
+bool wantService[NUM_SERVICES];
+bool byService;
+
+typedef struct {
+    uint16_t fileId;
+    int offset;
+    // if not 0, this isn't a packet: everything written to the file so far
+    // moves up by shift bytes, because an earlier packet address showed up
+    int shift;
+    uint8_t data[PACKET_DATA_LEN];
+} SinkPacket;
+
+typedef struct {
+    int fd;
+    // writer's use count when the file was last written, for LRU eviction
+    uint64_t lastUse;
+} SinkOpenFile;
+
+typedef struct {
+    uint8_t serviceId;
+    std::string dir;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<SinkPacket> queue;
+    bool done;
+    // only touched by the writer thread
+    std::map<uint16_t, SinkOpenFile> openFiles;
+    std::map<uint16_t, bool> created;
+    uint64_t useCount;
+    uint64_t numPackets;
+    uint64_t numWrites;
+    uint64_t numBytes;
+    double writeSeconds;
+    int errors;
+} ServiceSink;
+
+ServiceSink *sinks[NUM_SERVICES];
+
+int SinkFile(ServiceSink *sink, uint16_t fileId) {
+    sink->useCount++;
+    auto it = sink->openFiles.find(fileId);
+    if (it != sink->openFiles.end()) {
+        it->second.lastUse = sink->useCount;
+        return it->second.fd;
+    }
+    if (sink->openFiles.size() >= SINK_MAX_OPEN) {
+        auto oldest = sink->openFiles.begin();
+        for (auto file = sink->openFiles.begin(); file != sink->openFiles.end(); ++file) {
+            if (file->second.lastUse < oldest->second.lastUse) {
+                oldest = file;
+            }
+        }
+        SfClose(oldest->second.fd);
+        sink->openFiles.erase(oldest);
+    }
+
+    std::string filename = std::format("{}/{}.sa", sink->dir, fileId);
+    int fd;
+    bool created = sink->created.count(fileId);
+    if (created) {
+        fd = SfOpenUpdate(filename.c_str());
+    }
+    else {
+        fd = SfOpenWrite(filename.c_str());
+    }
+    if (fd < 0) {
+        printf("couldn't %s %s\n", created ? "reopen" : "create", filename.c_str());
         return -1;
     }
+    sink->created[fileId] = true;
+    sink->openFiles[fileId] = { fd, sink->useCount };
+    return fd;
+}
+
+// writes count packets that cover one run of consecutive offsets in a file
+void SinkWriteRun(ServiceSink *sink, uint16_t fileId, int offset, std::vector<uint8_t> &run, int count) {
+    int fd = SinkFile(sink, fileId);
+    if ((fd < 0) || (SfTransfer(fd, run.data(), run.size(), offset, 1) != (long)run.size())) {
+        sink->errors += count;
+        return;
+    }
+    sink->numPackets += count;
+    sink->numWrites++;
+    sink->numBytes += run.size();
+}
+
+// moves everything written to a file so far up by shift bytes
+void SinkShiftFile(ServiceSink *sink, uint16_t fileId, int shift) {
+    if (!sink->created.count(fileId)) { return; }
+    int fd = SinkFile(sink, fileId);
+    if (fd < 0) {
+        sink->errors++;
+        return;
+    }
+    std::string filename = std::format("{}/{}.sa", sink->dir, fileId);
+    int readFd = SfOpenRead(filename.c_str());
+    int64_t size = (readFd < 0) ? -1 : SfFileSize(readFd);
+    std::vector<uint8_t> contents((size < 0) ? 0 : (shift + size));
+    if ((size < 0) || (SfTransfer(readFd, contents.data() + shift, size, 0, 0) != (long)size) ||
+        (SfTransfer(fd, contents.data(), contents.size(), 0, 1) != (long)contents.size())) {
+        printf("couldn't move %s\n", filename.c_str());
+        sink->errors++;
+    }
+    if (readFd >= 0) { SfClose(readFd); }
+}
+
+// writes a range of packets from a batch. a stable sort keeps repeats of a
+// packet in arrival order, so the last one received still wins.
+void SinkWritePackets(ServiceSink *sink, std::deque<SinkPacket>::iterator first, std::deque<SinkPacket>::iterator last,
+                      std::vector<uint8_t> &run) {
+    std::stable_sort(first, last, [](const SinkPacket &a, const SinkPacket &b) {
+        return (a.fileId != b.fileId) ? (a.fileId < b.fileId) : (a.offset < b.offset);
+    });
+    int runStart = 0;
+    int runCount = 0;
+    uint16_t runFile = 0;
+    for (auto it = first; it != last; ++it) {
+        const SinkPacket &packet = *it;
+        if (runCount && (packet.fileId == runFile)) {
+            int runEnd = runStart + (int)run.size();
+            if (packet.offset == (runEnd - PACKET_DATA_LEN)) {
+                memcpy(run.data() + run.size() - PACKET_DATA_LEN, packet.data, PACKET_DATA_LEN);
+                runCount++;
+                continue;
+            }
+            if (packet.offset == runEnd) {
+                run.insert(run.end(), packet.data, packet.data + PACKET_DATA_LEN);
+                runCount++;
+                continue;
+            }
+        }
+        if (runCount) {
+            SinkWriteRun(sink, runFile, runStart, run, runCount);
+        }
+        run.assign(packet.data, packet.data + PACKET_DATA_LEN);
+        runFile = packet.fileId;
+        runStart = packet.offset;
+        runCount = 1;
+    }
+    if (runCount) {
+        SinkWriteRun(sink, runFile, runStart, run, runCount);
+    }
+}
+
+void SinkWriter(ServiceSink *sink) {
+    std::deque<SinkPacket> batch;
+    std::vector<uint8_t> run;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(sink->lock);
+            sink->cond.wait(lock, [sink] { return !sink->queue.empty() || sink->done; });
+            if (sink->queue.empty()) { break; }
+            batch.swap(sink->queue);
+        }
+        sink->cond.notify_all();
+
+        // packets are only reordered between shifts, since a shift changes
+        // where the packets after it go
+        auto start = std::chrono::steady_clock::now();
+        auto first = batch.begin();
+        for (auto it = batch.begin(); it != batch.end(); ++it) {
+            if (it->shift) {
+                SinkWritePackets(sink, first, it, run);
+                SinkShiftFile(sink, it->fileId, it->shift);
+                first = it + 1;
+            }
+        }
+        SinkWritePackets(sink, first, batch.end(), run);
+        sink->writeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        batch.clear();
+    }
 
-    // load the image file into ram
-    FILE *infile = fopen(argv[1], "rb");
-    if (!infile) {
-        printf("couldn't open %s\n", argv[1]);
+    for (auto const &file : sink->openFiles) {
+        SfClose(file.second.fd);
+    }
+}
+
+ServiceSink *GetSink(uint8_t serviceId, const char *outDir) {
+    if (!sinks[serviceId]) {
+        ServiceSink *sink = new ServiceSink();
+        sink->serviceId = serviceId;
+        sink->dir = std::format("{}/{}", outDir, (int)serviceId);
+        std::filesystem::create_directories(sink->dir);
+        sink->thread = std::thread(SinkWriter, sink);
+        sinks[serviceId] = sink;
+    }
+    return sinks[serviceId];
+}
+
+void SinkPush(ServiceSink *sink, const SinkPacket &packet) {
+    {
+        std::unique_lock<std::mutex> lock(sink->lock);
+        sink->cond.wait(lock, [sink] { return sink->queue.size() < SINK_QUEUE_LEN; });
+        sink->queue.push_back(packet);
+    }
+    sink->cond.notify_all();
+}
+
+// waits for every writer to finish and prints how each service did. returns
+// the number of packets that couldn't be written.
+int FinishSinks() {
+    int errors = 0;
+    for (int i = 0; i < NUM_SERVICES; i++) {
+        ServiceSink *sink = sinks[i];
+        if (!sink) { continue; }
+        {
+            std::lock_guard<std::mutex> lock(sink->lock);
+            sink->done = true;
+        }
+        sink->cond.notify_all();
+        sink->thread.join();
+
+        double mb = sink->numBytes / (1024.0 * 1024.0);
+        printf("service %d: %zu files, %llu packets in %llu writes, %.2f MB, %.1f MB/s%s\n", i, sink->created.size(),
+               (unsigned long long)sink->numPackets, (unsigned long long)sink->numWrites, mb, sink->writeSeconds ? (mb / sink->writeSeconds) : 0.0,
+               sink->errors ? " (write errors)" : "");
+        errors += sink->errors;
+    }
+    return errors;
+}
+
+bool IsComplete(const GameFile &file) {
+    if (file.dropped) {
+        return false;
+    }
+    int numPackets = (file.len + PACKET_DATA_LEN - 1) / PACKET_DATA_LEN;
+    for (int i = 0; i < numPackets; i++) {
+        if (!(file.received[i >> 3] & (1 << (i & 7)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// writes each file to outDir/<fileId>.sa, or outDir/<fileId>-<serviceId>.sa
+// if more than one service has that file id, keeping several writes in flight.
+// returns the number of files that couldn't be written.
+int WriteSaFiles(SfIo *io, const std::string &outDir, const std::vector<OutFile> &files) {
+    std::filesystem::create_directory(outDir);
+    int errors = 0;
+    std::map<uint16_t, int> idCount;
+    for (auto const &file : files) {
+        idCount[file.fileId]++;
+    }
+    std::string filename;
+    SfIoOp writes[SF_IO_DEPTH];
+    int inFlight = 0;
+    int next = 0;
+    for (auto const &file : files) {
+        SfIoOp &op = writes[next];
+        if (inFlight == SF_IO_DEPTH) {
+            if (SfIoWait(io, &op) != (long)op.len) {
+                printf("error writing file\n");
+                errors++;
+            }
+            SfClose(op.fd);
+            inFlight--;
+        }
+        if (idCount[file.fileId] > 1) {
+            filename = std::format("{}/{}-{}.sa", outDir, file.fileId, (int)file.serviceId);
+        }
+        else {
+            filename = std::format("{}/{}.sa", outDir, file.fileId);
+        }
+        op.fd = SfOpenWrite(filename.c_str());
+        if (op.fd < 0) {
+            printf("couldn't create %s\n", filename.c_str());
+            errors++;
+            continue;
+        }
+        op.buf = file.data;
+        op.len = file.len;
+        op.off = 0;
+        op.write = 1;
+        SfIoSubmit(io, &op);
+        inFlight++;
+        next = (next + 1) % SF_IO_DEPTH;
+    }
+    for (; inFlight; inFlight--) {
+        SfIoOp &op = writes[(next + SF_IO_DEPTH - inFlight) % SF_IO_DEPTH];
+        if (SfIoWait(io, &op) != (long)op.len) {
+            printf("error writing file\n");
+            errors++;
+        }
+        SfClose(op.fd);
+    }
+    return errors;
+}
+
+// writes every decoded file into one archive (see sfarchive.h) in a single
+// sequential pass
+int WriteArchive(SfIo *io, const char *path) {
+    SfWriter outfile;
+    if (SfWriterOpen(&outfile, io, path)) {
+        printf("couldn't create %s\n", path);
+        return -1;
+    }
+
+    SfaHeader header;
+    memcpy(header.magic, SFA_MAGIC, sizeof(header.magic));
+    header.version = SFA_VERSION;
+    header.numEntries = (uint32_t)gameFiles.size();
+    header.entrySize = sizeof(SfaEntry);
+    SfWrite(&outfile, &header, sizeof(header));
+
+    uint64_t offset = sizeof(SfaHeader) + (gameFiles.size() * sizeof(SfaEntry));
+    for (auto const &game : gameFiles) {
+        SfaEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.fileId = game.second.fileId;
+        entry.serviceId = game.second.serviceId;
+        entry.complete = IsComplete(game.second);
+        entry.base = game.second.base;
+        entry.offset = offset;
+        entry.len = game.second.len;
+        entry.crc = SfaCrc32(game.second.data, game.second.len);
+        SfWrite(&outfile, &entry, sizeof(entry));
+        offset += entry.len;
+    }
+    for (auto const &game : gameFiles) {
+        SfWrite(&outfile, game.second.data, game.second.len);
+    }
+
+    if (SfWriterClose(&outfile)) {
+        printf("error writing %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// extracts the .sa files from an archive made with --archive
+int Unpack(SfIo *io, const char *path, const char *outDir) {
+    SfMap map;
+    if (SfMapFile(&map, path)) {
+        printf("couldn't open %s\n", path);
         return -2;
     }
-    fseek(infile, 0, SEEK_END);
-    size_t fileSize = ftell(infile);
-    rewind(infile);
-    if (fileSize % (PACKET_LEN * NUM_PIPES)) {
-        printf("%s: invalid file\n", argv[1]);
-        fclose(infile);
+    uint32_t numEntries;
+    const SfaEntry *entries = SfaIndex(map.data, map.size, &numEntries);
+    if (!entries) {
+        printf("%s: invalid archive\n", path);
+        SfUnmapFile(&map);
         return -3;
     }
-    // never freed because this is a one-shot program
-    uint8_t *fileData = (uint8_t *)malloc(fileSize);
-    if (!fileData) { abort(); }
-    fread(fileData, 1, fileSize, infile);
-    fclose(infile);
-
-    // decode the file data from the packets in the image file
-    size_t fileCursor = 0;
-    while (fileCursor < fileSize) {
-        DeWeave(fileData + fileCursor);
-        fileCursor += (PACKET_LEN * NUM_PIPES);
-
-        uint8_t serviceId;
-        uint16_t fileId;
-        uint16_t address;
-        for (int i = 0; i < NUM_PIPES; i++) {
-            DeInterLeave(pipes[i]);
-            serviceId = 0;
-            OrBits(pipes[i], 32, &serviceId, 7);
-            serviceId = RevBits8(serviceId, 7);
-            fileId = 0;
-            OrBits(pipes[i], 39, (uint8_t *)&fileId, 14);
-            fileId = RevBits16(fileId, 14);
-            address = 0;
-            OrBits(pipes[i], 53, (uint8_t *)&address, 15);
-            address = RevBits16(address, 15);
-
-            if (fileId != 0x3fff) {
-                if (!gameFiles.count(fileId)) {
-                    printf("found new file: %u sid: %u\n", fileId, serviceId);
-                    memset(&newFile, 0, sizeof(newFile));
-                    newFile.base = address;
-                    newFile.len = 0;
-                    gameFiles[fileId] = newFile;
+
+    std::vector<OutFile> files;
+    int badEntries = 0;
+    for (uint32_t i = 0; i < numEntries; i++) {
+        const SfaEntry &entry = entries[i];
+        uint8_t *data = (uint8_t *)map.data + entry.offset;
+        if (SfaCrc32(data, entry.len) != entry.crc) {
+            printf("%u: bad crc, skipping\n", entry.fileId);
+            badEntries++;
+            continue;
+        }
+        printf("file: %u sid: %u%s\n", entry.fileId, entry.serviceId, entry.complete ? "" : " (incomplete)");
+        files.push_back({ entry.fileId, entry.serviceId, data, (int)entry.len });
+    }
+    int writeErrors = WriteSaFiles(io, outDir, files);
+
+    SfUnmapFile(&map);
+    if (writeErrors) {
+        return -1;
+    }
+    if (badEntries) {
+        printf("%d corrupt entries in %s\n", badEntries, path);
+        return -4;
+    }
+    return 0;
+}
+
+// parses a comma separated list of service ids into wantService
+bool ParseServices(const char *list) {
+    memset(wantService, 0, sizeof(wantService));
+    while (*list) {
+        char *end;
+        long serviceId = strtol(list, &end, 10);
+        if ((end == list) || (serviceId < 0) || (serviceId >= NUM_SERVICES) || (*end && (*end != ','))) {
+            return false;
+        }
+        wantService[serviceId] = true;
+        list = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+// moves a file's start back to an earlier packet address, for captures that
+// begin partway through a file. returns false if the file would get too big.
+bool RebaseFile(GameFile &file, int address, const char *outPath) {
+    int shift = file.base - address;
+    int shiftLen = shift * PACKET_DATA_LEN;
+    if ((file.len + shiftLen) > MAX_FILE_LEN) {
+        return false;
+    }
+
+    uint8_t received[sizeof(file.received)];
+    memset(received, 0, sizeof(received));
+    for (int i = 0; i < (file.len / PACKET_DATA_LEN); i++) {
+        if (file.received[i >> 3] & (1 << (i & 7))) {
+            received[(i + shift) >> 3] |= (1 << ((i + shift) & 7));
+        }
+    }
+    memcpy(file.received, received, sizeof(received));
+    if (byService) {
+        SinkPacket packet;
+        packet.fileId = file.fileId;
+        packet.offset = 0;
+        packet.shift = shiftLen;
+        SinkPush(GetSink(file.serviceId, outPath), packet);
+    }
+    else {
+        memmove(file.data + shiftLen, file.data, file.len);
+        memset(file.data, 0, shiftLen);
+    }
+    file.base = address;
+    file.len += shiftLen;
+    return true;
+}
+
+// decodes the packets in the superframe that's in pipes and adds them to
+// their files. packets whose data fails its BCH or parity check are left out
+// and counted in badData, pipes without a good header in badHeaders.
+void DecodeSuperframe(unsigned goodPipes, const char *outPath, int *badHeaders, int *badData) {
+    uint8_t serviceId;
+    uint16_t fileId;
+    uint16_t address;
+    for (int i = 0; i < NUM_PIPES; i++) {
+        if (!(goodPipes & (1 << i))) {
+            (*badHeaders)++;
+            continue;
+        }
+        DeInterLeave(pipes[i]);
+        serviceId = 0;
+        OrBits(pipes[i], 32, &serviceId, 7);
+        serviceId = RevBits8(serviceId, 7);
+        fileId = 0;
+        OrBits(pipes[i], 39, (uint8_t *)&fileId, 14);
+        fileId = RevBits16(fileId, 14);
+        address = 0;
+        OrBits(pipes[i], 53, (uint8_t *)&address, 15);
+        address = RevBits16(address, 15);
+
+        if (fileId != 0x3fff) {
+            if (!wantService[serviceId]) {
+                continue;
+            }
+            if (!DataValid(pipes[i])) {
+                (*badData)++;
+                continue;
+            }
+            uint32_t key = GameFileKey(fileId, serviceId);
+            if (!gameFiles.count(key)) {
+                printf("found new file: %u sid: %u\n", fileId, serviceId);
+                GameFile newFile;
+                memset(&newFile, 0, sizeof(newFile));
+                newFile.base = address;
+                newFile.len = 0;
+                newFile.fileId = fileId;
+                newFile.serviceId = serviceId;
+                if (!byService) {
+                    newFile.data = (uint8_t *)calloc(1, MAX_FILE_LEN);
+                    if (!newFile.data) { abort(); }
                 }
-                GameFile &file = gameFiles[fileId];
-                int offset = (address - file.base) * PACKET_DATA_LEN;
-                if (offset < 0) {
-                    printf("\n%d: negative offset!\n", fileId);
+                gameFiles[key] = newFile;
+            }
+            GameFile &file = gameFiles[key];
+            if ((address < file.base) && !RebaseFile(file, address, outPath)) {
+                printf("\n%d: file too big!\n", fileId);
+                file.dropped = true;
+                continue;
+            }
+            int packetNum = address - file.base;
+            int offset = packetNum * PACKET_DATA_LEN;
+            if ((offset + PACKET_DATA_LEN) > MAX_FILE_LEN) {
+                printf("\n%d: file too big!\n", fileId);
+                file.dropped = true;
+            }
+            else {
+                if (byService) {
+                    SinkPacket packet;
+                    packet.fileId = fileId;
+                    packet.offset = offset;
+                    packet.shift = 0;
+                    GetData(pipes[i], packet.data);
+                    SinkPush(GetSink(serviceId, outPath), packet);
                 }
                 else {
                     GetData(pipes[i], file.data + offset);
-                    if ((offset + PACKET_DATA_LEN) > file.len) {
-                        file.len = offset + PACKET_DATA_LEN;
-                    }
                 }
+                file.received[packetNum >> 3] |= (1 << (packetNum & 7));
+                if ((offset + PACKET_DATA_LEN) > file.len) {
+                    file.len = offset + PACKET_DATA_LEN;
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    bool archive = false;
+    bool unpack = false;
+    int arg = 1;
+    memset(wantService, 1, sizeof(wantService));
+    for (; (arg < argc) && !strncmp(argv[arg], "--", 2); arg++) {
+        if (!strcmp(argv[arg], "--archive")) {
+            archive = true;
+        }
+        else if (!strcmp(argv[arg], "--unpack")) {
+            unpack = true;
+        }
+        else if (!strcmp(argv[arg], "--by-service")) {
+            byService = true;
+        }
+        else if (!strcmp(argv[arg], "--services") && ((arg + 1) < argc)) {
+            if (!ParseServices(argv[++arg])) {
+                printf("bad service list %s\n", argv[arg]);
+                return -1;
             }
         }
+        else {
+            printf("unknown option %s\n", argv[arg]);
+            return -1;
+        }
+    }
+    if ((argc - arg) < 2) {
+        printf("use: densf [--archive | --by-service] [--services 1,2,...] file.img out\n"
+               "     (out is a directory, or an archive file with --archive)\n"
+               "     densf --unpack archive outdir\n");
+        return -1;
+    }
+    const char *inPath = argv[arg];
+    const char *outPath = argv[arg + 1];
+    if (archive && byService) {
+        printf("--archive and --by-service can't be used together\n");
+        return -1;
+    }
+
+    SfIo io;
+    SfIoInit(&io);
+
+    if (unpack) {
+        int ret = Unpack(&io, inPath, outPath);
+        SfIoShutdown(&io);
+        return ret;
+    }
+
+    // stream the image file in, the next block is read while this one decodes
+    SfReader infile;
+    if (SfReaderOpen(&infile, &io, inPath)) {
+        printf("couldn't open %s\n", inPath);
+        return -2;
+    }
+
+    // decode the file data from the packets in the image file. the image can
+    // start anywhere and have garbage or dropped bytes in it, so superframes
+    // are found by checking their headers, and after losing sync the search
+    // picks back up one byte past where it was lost.
+    BuildSyncTables();
+    static SyncWindow window;
+    window.reader = &infile;
+    bool inSync = false;
+    uint64_t lostPos = 0;
+    uint64_t totalSkipped = 0;
+    int badHeaders = 0;
+    int badData = 0;
+    for (;;) {
+        size_t avail = FillWindow(&window);
+        if (avail < SUPERFRAME_LEN) {
+            uint64_t skipStart = inSync ? window.pos : lostPos;
+            uint64_t skipLen = window.pos + avail - skipStart;
+            if (skipLen && !infile.error) {
+                printf("skipped %llu bytes at 0x%llx (end of file)\n", (unsigned long long)skipLen, (unsigned long long)skipStart);
+                totalSkipped += skipLen;
+            }
+            break;
+        }
+
+        if (!inSync) {
+            size_t next = ScanForSync(window.buf + window.start, avail - SUPERFRAME_LEN + 1);
+            if (next) {
+                Skip(&window, next);
+                continue;
+            }
+        }
+
+        unsigned goodPipes;
+        int good = CheckSuperframe(window.buf + window.start, &goodPipes);
+        if (good < SYNC_MIN_PIPES) {
+            if (inSync) {
+                inSync = false;
+                lostPos = window.pos;
+            }
+            Skip(&window, 1);
+            continue;
+        }
+        if (good < NUM_PIPES) {
+            uint64_t oldPos = window.pos;
+            int slip = AlignSuperframe(&window, inSync, &goodPipes, good);
+            if (inSync && (slip < 0)) {
+                printf("lost %d bytes before 0x%llx\n", -slip, (unsigned long long)oldPos);
+            }
+            else if (inSync && slip) {
+                printf("skipped %d bytes at 0x%llx\n", slip, (unsigned long long)oldPos);
+                totalSkipped += slip;
+            }
+        }
+        if (!inSync) {
+            if (window.pos != lostPos) {
+                printf("skipped %llu bytes at 0x%llx\n", (unsigned long long)(window.pos - lostPos), (unsigned long long)lostPos);
+                totalSkipped += window.pos - lostPos;
+            }
+            inSync = true;
+        }
+
+        DeWeave(window.buf + window.start);
+        Skip(&window, SUPERFRAME_LEN);
+        DecodeSuperframe(goodPipes, outPath, &badHeaders, &badData);
+    }
+
+    SfReaderClose(&infile);
+    if (infile.error) {
+        printf("error reading %s\n", inPath);
+        SfIoShutdown(&io);
+        return -4;
+    }
+    if (totalSkipped || badHeaders || badData) {
+        printf("%llu bytes skipped, %d packets with bad headers, %d packets with bad data\n", (unsigned long long)totalSkipped, badHeaders, badData);
     }
 
     // write out the decoded files to disk
-    std::string outDir = std::string(argv[2]);
-    std::filesystem::create_directory(outDir);
-    std::string filename;
-    for (auto const &game : gameFiles) {
-        filename = std::format("{}/{}.sa", outDir, game.first);
-        FILE *outfile = fopen(filename.c_str(), "wb");
-        fwrite(game.second.data, 1, game.second.len, outfile);
-        fclose(outfile);
+    int ret = 0;
+    if (byService) {
+        if (FinishSinks()) {
+            ret = -1;
+        }
     }
+    else if (archive) {
+        ret = WriteArchive(&io, outPath);
+    }
+    else {
+        std::vector<OutFile> files;
+        for (auto &game : gameFiles) {
+            files.push_back({ game.second.fileId, game.second.serviceId, game.second.data, game.second.len });
+        }
+        if (WriteSaFiles(&io, outPath, files)) {
+            ret = -1;
+        }
+    }
+    SfIoShutdown(&io);
 
-    return 0;
+    return ret;
 }
@@ -9,11 +9,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "sfio.h"
 
 FILE *logfile;
-#define ERR_EXIT(...) do { printf(__VA_ARGS__); fprintf(logfile, __VA_ARGS__); abort(); } while(0)
+#define ERR_EXIT(...) do { printf(__VA_ARGS__); fprintf(logfile, __VA_ARGS__); fflush(stdout); fflush(logfile); abort(); } while(0)
 
-FILE *pMap;
+SfIo io;
+SfMap pMap;
 
 #define NUM_PIPES 10
 #define PACKET_LEN 288
@@ -49,28 +51,183 @@ void Setup(int *maxPackets, int *maxFile, char *outname) {
     fprintf(logfile, "MaxPackets=%d MaxFile=%d Outname=%s\n", *maxPackets, *maxFile, outname);
 }
 
-void GetData(int pipeNum, int packetNum, uint16_t *pAddress, uint8_t *data, uint16_t *fileId, uint16_t *rAddress, uint16_t *gameTimeWord, uint8_t *serviceId) {
-    long seekaddress;
-    char fileInName[PATH_LEN];
+// --- pmap ---
+// pmap.dat is mapped and every record nsf will use is checked before encoding
+// starts, so a bad schedule fails right away instead of partway through a run.
+// After that, any packet's record can be looked up directly.
+#define PMAP_MAX_ERRORS 20
+
+typedef struct {
+    char name[PATH_LEN];
+    int64_t size;
+} InputFile;
+InputFile *inputFiles;
+int numInputFiles;
+
+int CompareInputFiles(const void *a, const void *b) {
+    return strcmp(((const InputFile *)a)->name, ((const InputFile *)b)->name);
+}
 
-    if ((packetNum == 0) && (pipeNum == 0)) {
-        pMap = fopen("pmap.dat", "rb");
-        if (!pMap) {
-            ERR_EXIT("sf error - getdata - pmap not opened\n");
+// returns the size of a game data file, or -1 if it can't be opened
+int64_t InputFileSize(const char *name) {
+    static int capacity;
+    InputFile key;
+    strcpy(key.name, name);
+    InputFile *file = bsearch(&key, inputFiles, numInputFiles, sizeof(InputFile), CompareInputFiles);
+    if (file) { return file->size; }
+
+    int fd = SfOpenRead(name);
+    key.size = (fd < 0) ? -1 : SfFileSize(fd);
+    if (fd >= 0) { SfClose(fd); }
+
+    if (numInputFiles == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        inputFiles = realloc(inputFiles, capacity * sizeof(InputFile));
+        if (!inputFiles) { abort(); }
+    }
+    int pos = numInputFiles;
+    while ((pos > 0) && (strcmp(inputFiles[pos - 1].name, name) > 0)) {
+        pos--;
+    }
+    memmove(inputFiles + pos + 1, inputFiles + pos, (numInputFiles - pos) * sizeof(InputFile));
+    inputFiles[pos] = key;
+    numInputFiles++;
+    return key.size;
+}
+
+// copies the file name out of a pmap name field. returns 0 if it's empty or
+// doesn't fit in PATH_LEN.
+int PipeFileName(const char *field, char *fileInName) {
+    int start = 0;
+    while ((start < PATH_LEN) && ((field[start] == ' ') || (field[start] == '\t'))) {
+        start++;
+    }
+    int len = 0;
+    while (((start + len) < PATH_LEN) && field[start + len] && (field[start + len] != ' ') &&
+           (field[start + len] != '\t') && (field[start + len] != '\r') && (field[start + len] != '\n')) {
+        len++;
+    }
+    if (!len || ((start + len) == PATH_LEN)) { return 0; }
+    memcpy(fileInName, field + start, len);
+    fileInName[len] = '\0';
+    return 1;
+}
+
+void LoadPmap(int maxPackets) {
+    int errors = 0;
+#define PMAP_ERROR(...) do { \
+        if (errors++ < PMAP_MAX_ERRORS) { printf(__VA_ARGS__); fprintf(logfile, __VA_ARGS__); } \
+    } while (0)
+
+    if (SfMapFile(&pMap, "pmap.dat")) {
+        ERR_EXIT("sf error - getdata - pmap not opened\n");
+    }
+    if (pMap.size < ((int64_t)maxPackets * (int64_t)sizeof(struct PMS))) {
+        ERR_EXIT("sf error - pmap has %lld records, MaxPackets is %d\n", (long long)(pMap.size / sizeof(struct PMS)), maxPackets);
+    }
+
+    const struct PMS *records = (const struct PMS *)pMap.data;
+    char fileInName[PATH_LEN];
+    for (int packetNum = 0; packetNum < maxPackets; packetNum++) {
+        const struct PMS *record = &records[packetNum];
+        if (record->PMS_number != (uint32_t)packetNum * 512) {
+            PMAP_ERROR("sf error - pmap - packet %d has record number %u\n", packetNum, record->PMS_number);
+        }
+        for (int pipeNum = 0; pipeNum < NUM_PIPES; pipeNum++) {
+            if (!PipeFileName(record->FileInName[pipeNum], fileInName)) {
+                PMAP_ERROR("sf error - pmap - packet %d pipe %d - bad file name\n", packetNum, pipeNum);
+                continue;
+            }
+            if (fileInName[0] == '*') {
+                continue;
+            }
+            if (record->FileId[pipeNum] >= 0x3fff) {
+                PMAP_ERROR("sf error - pmap - packet %d pipe %d - file id %u out of range\n", packetNum, pipeNum, record->FileId[pipeNum]);
+            }
+            if ((record->PAddress[pipeNum] + record->RAddress[pipeNum]) >= 0x8000) {
+                PMAP_ERROR("sf error - pmap - packet %d pipe %d - address %u+%u out of range\n", packetNum, pipeNum,
+                           record->PAddress[pipeNum], record->RAddress[pipeNum]);
+            }
+            int64_t fileSize = InputFileSize(fileInName);
+            int64_t seekpack = ((int64_t)record->PAddress[pipeNum] * PACKET_DATA_LEN) + record->HeaderOffset[pipeNum];
+            if (fileSize < 0) {
+                PMAP_ERROR("sf error - pmap - packet %d pipe %d - can't open %s\n", packetNum, pipeNum, fileInName);
+            }
+            else if (seekpack >= fileSize) {
+                PMAP_ERROR("sf error - pmap - packet %d pipe %d - address %u is past the end of %s\n", packetNum, pipeNum,
+                           record->PAddress[pipeNum], fileInName);
+            }
         }
     }
+#undef PMAP_ERROR
 
-    seekaddress = packetNum * 512;
-    if (pipeNum == 0) {
-        fread(&PacketMapStruct, sizeof(PacketMapStruct), 1, pMap);
+    if (errors) {
+        ERR_EXIT("sf error - pmap - %d errors\n", errors);
     }
-    if (PacketMapStruct.PMS_number != seekaddress) {
-        printf("sf error - getdata - PMAP read address invalid - on %d\n", PacketMapStruct.PMS_number);
-        printf("packet=%d seekaddress=%d recsize=%zu\n", packetNum, seekaddress, sizeof(PacketMapStruct));
-        fprintf(logfile, "sf error - getdata - PMAP read address invalid - on %d\n", PacketMapStruct.PMS_number);
-        fclose(logfile);
-        abort();
+    fprintf(logfile, "pmap ok - %d packets, %d input files\n", maxPackets, numInputFiles);
+}
+
+const struct PMS *PmapRecord(int packetNum) {
+    return &((const struct PMS *)pMap.data)[packetNum];
+}
+
+// copies the pmap record for the packet into PacketMapStruct
+void GetPmapRecord(int packetNum) {
+    memcpy(&PacketMapStruct, PmapRecord(packetNum), sizeof(PacketMapStruct));
+}
+
+// --- game data ---
+// The game data for the next packet nsf encodes is read through its own SfIo
+// while the current packet is encoded. Each pipe keeps its input file open for
+// as long as it keeps reading from the same file.
+SfIo dataIo;
+
+typedef struct {
+    SfIoOp ops[NUM_PIPES];
+    uint8_t data[NUM_PIPES][PACKET_DATA_LEN];
+} PacketReads;
+
+// the packet being encoded and the one being read ahead
+PacketReads packetReads[2];
+
+// starts reading the game data for every data pipe of the packet. the reads of
+// the packet before it must be finished, since their files may get closed.
+void PrefetchData(PacketReads *reads, int packetNum) {
+    static int dataFds[NUM_PIPES];
+    static char dataNames[NUM_PIPES][PATH_LEN];
+    const struct PMS *record = PmapRecord(packetNum);
+    char fileInName[PATH_LEN];
+
+    for (int pipeNum = 0; pipeNum < NUM_PIPES; pipeNum++) {
+        PipeFileName(record->FileInName[pipeNum], fileInName);
+        if (fileInName[0] == '*') {
+            continue;
+        }
+        if (!dataNames[pipeNum][0] || strcmp(dataNames[pipeNum], fileInName)) {
+            if (dataNames[pipeNum][0]) { SfClose(dataFds[pipeNum]); }
+            dataFds[pipeNum] = SfOpenRead(fileInName);
+            if (dataFds[pipeNum] < 0) {
+                ERR_EXIT("sf error - opening game data - %s\n", fileInName);
+            }
+            strcpy(dataNames[pipeNum], fileInName);
+        }
+
+        SfIoOp *op = &reads->ops[pipeNum];
+        op->fd = dataFds[pipeNum];
+        op->buf = reads->data[pipeNum];
+        op->len = PACKET_DATA_LEN;
+        op->off = ((int64_t)record->PAddress[pipeNum] * PACKET_DATA_LEN) + record->HeaderOffset[pipeNum];
+        op->write = 0;
+        SfIoSubmit(&dataIo, op);
     }
+}
+
+// returns 1 if the pipe is filler for this packet, 0 if it has game data. the
+// data is left in reads->data[pipeNum], for game data once its read finishes.
+int GetData(int pipeNum, PacketReads *reads, uint16_t *pAddress, uint16_t *fileId, uint16_t *rAddress, uint16_t *gameTimeWord, uint8_t *serviceId) {
+    char fileInName[PATH_LEN];
+    uint8_t *data = reads->data[pipeNum];
+
     if ((pipeNum < 0) || (pipeNum > 9)) {
         ERR_EXIT("sf error - getdata - incorrect mux for PMAP\n");
     }
@@ -80,21 +237,17 @@ void GetData(int pipeNum, int packetNum, uint16_t *pAddress, uint8_t *data, uint
     *fileId = PacketMapStruct.FileId[pipeNum];
     *gameTimeWord = PacketMapStruct.GameTimeWord[pipeNum];
     *serviceId = PacketMapStruct.ServiceID[pipeNum];
-    sscanf(PacketMapStruct.FileInName[pipeNum], "%s\n", fileInName);
+    PipeFileName(PacketMapStruct.FileInName[pipeNum], fileInName);
     if (fileInName[0] != '*') {
-        FILE *dataFile = fopen(fileInName, "rb");
-        if (!dataFile) {
-            ERR_EXIT("sf error - opening game data - %s\n", fileInName);
-        }
-
-        long seekpack = (*pAddress * PACKET_DATA_LEN) + PacketMapStruct.HeaderOffset[pipeNum];
-        if (fseek(dataFile, seekpack, SEEK_SET)) {
-            ERR_EXIT("sf error - GetData - on DataSeek - %s\n", fileInName);
-        }
-        if (!fread(data, 1, PACKET_DATA_LEN, dataFile)) {
-            ERR_EXIT("sf error - getdata - on read\n");
-        }
-        fclose(dataFile);
+        long numRead = SfIoWait(&dataIo, &reads->ops[pipeNum]);
+        if (numRead <= 0) {
+            ERR_EXIT("sf error - getdata - on read - %s\n", fileInName);
+        }
+        // the last packet of a file can be short. its tail is zeroed instead
+        // of keeping whatever this buffer held last, so the encoded packet and
+        // its hash only depend on the file's own bytes.
+        memset(data + numRead, 0, PACKET_DATA_LEN - numRead);
+        return 0;
     }
     else {
         *pAddress = 0;
@@ -104,6 +257,7 @@ void GetData(int pipeNum, int packetNum, uint16_t *pAddress, uint8_t *data, uint
             data[i] = 0;
             data[i + 1] = 1;
         }
+        return 1;
     }
 }
 
@@ -463,56 +617,309 @@ void InterLeave(int pipeNum, uint8_t *frame) {
     }
 }
 
-void SaveFrame(uint8_t *frame, char *path, int packetNum, int maxPackets) {
-    static FILE *outfile;
+// Filler packets only differ in the game time bits and service ID in their
+// header, so each variant is only run through LoadFrame and InterLeave the first
+// time it comes up, and copied into the frame after that.
+#define FILLER_VARIANTS (2 * 2 * 128)
+uint8_t fillerFrames[FILLER_VARIANTS][PACKET_LEN];
+uint8_t fillerBuilt[FILLER_VARIANTS];
 
-    if (packetNum == 0) {
-        outfile = fopen(path, "wb");
-        if (!outfile) {
-            ERR_EXIT("sf error - creating outfile\n");
-        }
+void LoadFiller(int pipeNum, uint16_t pAddress, uint16_t rAddress, uint16_t fileID, uint8_t *frame, uint8_t *data, uint16_t gameTimeWord, uint8_t serviceID) {
+    // same game time bits as LoadFrame
+    uint8_t gameTimeSelect = 0xf - (pAddress & 0xf);
+    uint8_t gameTimeBit = (PacketMapStruct.GameTimeWord[pipeNum] & (1 << gameTimeSelect)) >> gameTimeSelect;
+    uint8_t gameTimeSync = !gameTimeSelect;
+    int variant = (gameTimeSync << 8) | (gameTimeBit << 7) | (serviceID & 0x7f);
+
+    if (!fillerBuilt[variant]) {
+        LoadFrame(pipeNum, pAddress, rAddress, fileID, frame, data, gameTimeWord, serviceID);
+        InterLeave(pipeNum, frame);
+        memcpy(fillerFrames[variant], frame + (pipeNum * PACKET_LEN), PACKET_LEN);
+        fillerBuilt[variant] = 1;
+    }
+    else {
+        memcpy(frame + (pipeNum * PACKET_LEN), fillerFrames[variant], PACKET_LEN);
     }
+}
+
+void WeaveFrame(uint8_t *frame, uint8_t *woven) {
+    int cursor = 0;
+
     for (int i = 0; i < PACKET_LEN; i += 2) {
         for (int pipeNum = 0; pipeNum < NUM_PIPES; pipeNum++) {
             if (((pipeNum * PACKET_LEN) + i) == 2592) {
                 fprintf(logfile, "\nloaded %d %d @ %x %x\n", pipeNum, i, frame[2592], frame[2593]);
             }
-            fputc(frame[(pipeNum * PACKET_LEN) + i], outfile);
-            fputc(frame[(pipeNum * PACKET_LEN) + i + 1], outfile);
+            woven[cursor++] = frame[(pipeNum * PACKET_LEN) + i];
+            woven[cursor++] = frame[(pipeNum * PACKET_LEN) + i + 1];
+        }
+    }
+}
+
+void SaveFrame(uint8_t *frame, char *path, int packetNum, int maxPackets) {
+    static SfWriter outfile;
+    uint8_t woven[PACKET_LEN * NUM_PIPES];
+
+    if (packetNum == 0) {
+        if (SfWriterOpen(&outfile, &io, path)) {
+            ERR_EXIT("sf error - creating outfile\n");
         }
     }
-    if (packetNum == maxPackets) {
-        fclose(outfile);
+    WeaveFrame(frame, woven);
+    SfWrite(&outfile, woven, sizeof(woven));
+    if (packetNum == (maxPackets - 1)) {
+        if (SfWriterClose(&outfile)) {
+            ERR_EXIT("sf error - writing outfile\n");
+        }
     }
 }
 
+// --- incremental update ---
+// A full run also writes <outname>.hash, with a hash of each packet's pmap
+// record and input data. With --update, nsf compares pmap.dat against the
+// pmap the image was built from and only looks at packets whose record changed
+// or that read from one of the listed changed files. Of those, the ones whose
+// hash changed are re-encoded and written over their superframe in the image.
+SfMap oldPMap;
+uint64_t *packetHashes;
+char (*changedFiles)[PATH_LEN];
+int numChanged;
+
+// FNV-1a
+#define HASH_SEED 0xcbf29ce484222325ULL
+uint64_t HashBytes(uint64_t hash, const void *buf, size_t len) {
+    const uint8_t *bytes = (const uint8_t *)buf;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void HashPath(char *hashPath, const char *path) {
+    snprintf(hashPath, PATH_LEN + 8, "%s.hash", path);
+}
+
+// returns 0 if there's no hash file for the image (or it's the wrong size)
+int LoadHashes(const char *path, int maxPackets) {
+    char hashPath[PATH_LEN + 8];
+    HashPath(hashPath, path);
+    FILE *fp = fopen(hashPath, "rb");
+    if (!fp) { return 0; }
+    size_t numRead = fread(packetHashes, sizeof(uint64_t), maxPackets, fp);
+    int extra = fgetc(fp) != EOF;
+    fclose(fp);
+    return (numRead == (size_t)maxPackets) && !extra;
+}
+
+void SaveHashes(const char *path, int maxPackets) {
+    char hashPath[PATH_LEN + 8];
+    HashPath(hashPath, path);
+    FILE *fp = fopen(hashPath, "wb");
+    if (!fp || (fwrite(packetHashes, sizeof(uint64_t), maxPackets, fp) != (size_t)maxPackets)) {
+        ERR_EXIT("sf error - writing %s\n", hashPath);
+    }
+    fclose(fp);
+}
+
+int CompareNames(const void *a, const void *b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+void LoadChangedFiles(const char *listPath) {
+    char name[256];
+    int capacity = 0;
+
+    FILE *fp = fopen(listPath, "r");
+    if (!fp) {
+        ERR_EXIT("sf error - opening changed file list %s\n", listPath);
+    }
+    while (fscanf(fp, "%255s", name) == 1) {
+        if (strlen(name) >= PATH_LEN) { continue; }
+        if (numChanged == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            changedFiles = realloc(changedFiles, capacity * PATH_LEN);
+            if (!changedFiles) { abort(); }
+        }
+        strcpy(changedFiles[numChanged++], name);
+    }
+    fclose(fp);
+    qsort(changedFiles, numChanged, PATH_LEN, CompareNames);
+}
+
+// checks a packet's pmap record against the old one and the changed files
+int PacketChanged(int packetNum, const struct PMS *record) {
+    const struct PMS *oldRecords = (const struct PMS *)oldPMap.data;
+    char fileInName[PATH_LEN];
+
+    if ((((int64_t)packetNum + 1) * (int64_t)sizeof(struct PMS)) > oldPMap.size) {
+        return 1;
+    }
+    if (memcmp(&oldRecords[packetNum], record, sizeof(struct PMS))) {
+        return 1;
+    }
+    for (int pipeNum = 0; pipeNum < NUM_PIPES; pipeNum++) {
+        PipeFileName(record->FileInName[pipeNum], fileInName);
+        if ((fileInName[0] != '*') && bsearch(fileInName, changedFiles, numChanged, PATH_LEN, CompareNames)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int patchFd;
+SfIoOp patchOps[SF_IO_DEPTH];
+uint8_t patchFrames[SF_IO_DEPTH][PACKET_LEN * NUM_PIPES];
+int patchPending[SF_IO_DEPTH];
+int patchNext;
+
+void FinishPatch(int slot) {
+    if (patchPending[slot] && (SfIoWait(&io, &patchOps[slot]) != (long)patchOps[slot].len)) {
+        ERR_EXIT("sf error - patching outfile\n");
+    }
+    patchPending[slot] = 0;
+}
+
+// writes the frame over its superframe in the existing image
+void PatchFrame(uint8_t *frame, int packetNum) {
+    int slot = patchNext;
+    patchNext = (patchNext + 1) % SF_IO_DEPTH;
+
+    FinishPatch(slot);
+    WeaveFrame(frame, patchFrames[slot]);
+    patchOps[slot].fd = patchFd;
+    patchOps[slot].buf = patchFrames[slot];
+    patchOps[slot].len = PACKET_LEN * NUM_PIPES;
+    patchOps[slot].off = (int64_t)packetNum * (PACKET_LEN * NUM_PIPES);
+    patchOps[slot].write = 1;
+    SfIoSubmit(&io, &patchOps[slot]);
+    patchPending[slot] = 1;
+}
+
+// returns the first packet from packetNum on that has to be encoded. with
+// --update that's only the packets PacketChanged picks out.
+int NextPacket(int packetNum, int maxPackets, int update) {
+    while (update && (packetNum < maxPackets) && !PacketChanged(packetNum, PmapRecord(packetNum))) {
+        packetNum++;
+    }
+    return packetNum;
+}
+
 int main(int argc, char **argv) {
     uint8_t frame[PACKET_LEN * NUM_PIPES];
-    uint8_t data[PACKET_DATA_LEN];
     char path[PATH_LEN];
-    uint8_t serviceID;
-    uint16_t gameTimeWord;
-    uint16_t fileID;
-    uint16_t rAddress;
-    uint16_t pAddress;
+    uint8_t serviceID[NUM_PIPES];
+    uint16_t gameTimeWord[NUM_PIPES];
+    uint16_t fileID[NUM_PIPES];
+    uint16_t rAddress[NUM_PIPES];
+    uint16_t pAddress[NUM_PIPES];
+    int filler[NUM_PIPES];
     int maxFile;
     int maxPackets;
+    int update = 0;
+
+    if ((argc == 4) && !strcmp(argv[1], "--update")) {
+        update = 1;
+    }
+    else if (argc != 1) {
+        printf("use: nsf\n"
+               "     nsf --update oldpmap.dat changed.lst\n");
+        return -1;
+    }
 
     logfile = fopen("sf.log", "w");
+    SfIoInit(&io);
+    SfIoInit(&dataIo);
+    fprintf(logfile, "I/O backend: %s\n", SfIoBackendName(&io));
 
     Setup(&maxPackets, &maxFile, path);
-	
+    LoadPmap(maxPackets);
+
+    packetHashes = malloc(maxPackets * sizeof(uint64_t));
+    if (!packetHashes) { abort(); }
+    int haveHashes = 0;
+    if (update) {
+        if (SfMapFile(&oldPMap, argv[2])) {
+            ERR_EXIT("sf error - opening old pmap %s\n", argv[2]);
+        }
+        LoadChangedFiles(argv[3]);
+        patchFd = SfOpenUpdate(path);
+        if (patchFd < 0) {
+            ERR_EXIT("sf error - opening outfile for update\n");
+        }
+        if (SfFileSize(patchFd) != ((int64_t)maxPackets * PACKET_LEN * NUM_PIPES)) {
+            ERR_EXIT("sf error - outfile size doesn't match MaxPackets\n");
+        }
+        haveHashes = LoadHashes(path, maxPackets);
+        if (!haveHashes) {
+            printf("no hashes for %s, re-encoding every changed packet\n", path);
+        }
+    }
+
+    int numEncoded = 0;
     printf("\nFormatting Frame\n");
-    for (int packetNum = 0; packetNum < maxPackets; packetNum++) {
+    int slot = 0;
+    int nextPacket;
+    int packetNum = NextPacket(0, maxPackets, update);
+    if (packetNum < maxPackets) {
+        PrefetchData(&packetReads[slot], packetNum);
+    }
+    for (; packetNum < maxPackets; packetNum = nextPacket) {
         printf("%5d\b\b\b\b\b\b", packetNum);
+        GetPmapRecord(packetNum);
+        PacketReads *reads = &packetReads[slot];
+        uint8_t (*data)[PACKET_DATA_LEN] = reads->data;
+
+        uint64_t hash = HashBytes(HASH_SEED, &PacketMapStruct, sizeof(PacketMapStruct));
+        for (int pipeNum = 0; pipeNum < NUM_PIPES; pipeNum++) {
+            filler[pipeNum] = GetData(pipeNum, reads, &pAddress[pipeNum], &fileID[pipeNum], &rAddress[pipeNum], &gameTimeWord[pipeNum], &serviceID[pipeNum]);
+            hash = HashBytes(hash, data[pipeNum], PACKET_DATA_LEN);
+        }
+
+        // read the next packet's data while this one is encoded
+        nextPacket = NextPacket(packetNum + 1, maxPackets, update);
+        slot ^= 1;
+        if (nextPacket < maxPackets) {
+            PrefetchData(&packetReads[slot], nextPacket);
+        }
+        if (update && haveHashes && (packetHashes[packetNum] == hash)) {
+            continue;
+        }
+        packetHashes[packetNum] = hash;
+
         memset(frame, 0, sizeof(frame));
         for (int pipeNum = 0; pipeNum < NUM_PIPES; pipeNum++) {
-            GetData(pipeNum, packetNum, &pAddress, data, &fileID, &rAddress, &gameTimeWord, &serviceID);
-            LoadFrame(pipeNum, pAddress, rAddress, fileID, frame, data, gameTimeWord, serviceID);
-            InterLeave(pipeNum, frame);
+            if (filler[pipeNum]) {
+                LoadFiller(pipeNum, pAddress[pipeNum], rAddress[pipeNum], fileID[pipeNum], frame, data[pipeNum], gameTimeWord[pipeNum], serviceID[pipeNum]);
+            }
+            else {
+                LoadFrame(pipeNum, pAddress[pipeNum], rAddress[pipeNum], fileID[pipeNum], frame, data[pipeNum], gameTimeWord[pipeNum], serviceID[pipeNum]);
+                InterLeave(pipeNum, frame);
+            }
+        }
+        if (update) {
+            PatchFrame(frame, packetNum);
+        }
+        else {
+            SaveFrame(frame, path, packetNum, maxPackets);
         }
-        SaveFrame(frame, path, packetNum, maxPackets);
+        numEncoded++;
+    }
+    SfUnmapFile(&pMap);
+
+    if (update) {
+        for (int i = 0; i < SF_IO_DEPTH; i++) {
+            FinishPatch(i);
+        }
+        SfClose(patchFd);
+        SfUnmapFile(&oldPMap);
+        printf("\nre-encoded %d of %d packets\n", numEncoded, maxPackets);
+    }
+    // without the old hashes, the unchanged packets' hashes are unknown
+    if (!update || haveHashes) {
+        SaveHashes(path, maxPackets);
     }
+    SfIoShutdown(&dataIo);
+    SfIoShutdown(&io);
 
     fclose(logfile);
     return 0;
@@ -0,0 +1,82 @@
+// sfarchive.h: Packed archive format for files extracted by densf.
+// An archive is a header, followed by one index entry per file, followed by
+// the file payloads back to back. The structures are written in host byte
+// order, which is little endian on every target densf builds for, and every
+// structure is naturally aligned, so a loader can mmap the archive and use the
+// index in place. A big endian host reads the version as a different number
+// and SfaIndex rejects the archive rather than misreading it.
+// I place this file in the public domain.
+
+#ifndef SFARCHIVE_H
+#define SFARCHIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SFA_MAGIC "SFAR"
+#define SFA_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t numEntries;
+    // size of one SfaEntry, so newer entries can grow without breaking readers
+    uint32_t entrySize;
+} SfaHeader;
+
+typedef struct {
+    uint16_t fileId;
+    uint8_t serviceId;
+    // 1 if every packet from the base address to the end of the file was seen
+    uint8_t complete;
+    // packet address the file starts at
+    uint32_t base;
+    // payload offset from the start of the archive
+    uint64_t offset;
+    uint32_t len;
+    // CRC-32 (zlib polynomial) of the payload
+    uint32_t crc;
+} SfaEntry;
+
+static inline uint32_t SfaCrc32(const uint8_t *data, size_t len) {
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int j = 0; j < 8; j++) {
+                c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+            }
+            table[i] = c;
+        }
+    }
+
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// checks that an archive image is sane and returns its index, or NULL
+static inline const SfaEntry *SfaIndex(const uint8_t *archive, uint64_t size, uint32_t *numEntries) {
+    const SfaHeader *header = (const SfaHeader *)archive;
+    if ((size < sizeof(SfaHeader)) || memcmp(header->magic, SFA_MAGIC, 4) ||
+        (header->version != SFA_VERSION) || (header->entrySize != sizeof(SfaEntry))) {
+        return NULL;
+    }
+    if (header->numEntries > ((size - sizeof(SfaHeader)) / sizeof(SfaEntry))) {
+        return NULL;
+    }
+
+    const SfaEntry *entries = (const SfaEntry *)(archive + sizeof(SfaHeader));
+    for (uint32_t i = 0; i < header->numEntries; i++) {
+        if ((entries[i].offset > size) || (entries[i].len > (size - entries[i].offset))) {
+            return NULL;
+        }
+    }
+    *numEntries = header->numEntries;
+    return entries;
+}
+
+#endif
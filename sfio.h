@@ -0,0 +1,652 @@
+// sfio.h: Double-buffered asynchronous file I/O shared by densf and nsf.
+// Readers prefetch the next block while the caller decodes the current one, and
+// writers flush full blocks in the background while the caller fills the next.
+// On Linux the transfers go through io_uring when the kernel supports it, with
+// a worker thread as the fallback. Windows builds do plain blocking I/O.
+// Build with -DSF_NO_IO_URING to force the thread fallback.
+// Also has a small read-only file mapping wrapper.
+// I place this file in the public domain.
+
+#ifndef SFIO_H
+#define SFIO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <malloc.h>
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// io_uring needs kernel headers from 5.6 or later, for IORING_OP_READ/WRITE.
+// those are enum values, so IORING_FEAT_RW_CUR_POS (also new in 5.6) stands in
+// for them. with older headers the worker thread is used instead.
+#if defined(__linux__) && !defined(SF_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(IORING_FEAT_SINGLE_MMAP) && defined(IORING_FEAT_RW_CUR_POS)
+#define SF_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+// transfer size for each half of a double buffer
+#define SF_IO_BLOCK (1024 * 1024)
+// buffer alignment (one page, good enough for O_DIRECT-friendly devices too)
+#define SF_IO_ALIGN 4096
+// max number of transfers in flight on one SfIo at a time. nsf reads every
+// pipe of a packet at once, so this has to be at least 10.
+#define SF_IO_DEPTH 16
+
+enum {
+    SF_BACKEND_SYNC,
+    SF_BACKEND_THREAD,
+    SF_BACKEND_URING,
+};
+
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t len;
+    int64_t off;
+    int write;
+    volatile int done;
+    // bytes transferred, or -errno
+    long result;
+} SfIoOp;
+
+typedef struct {
+    int backend;
+#ifdef SF_HAVE_IO_URING
+    int ringFd;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    // transfers submitted whose completions haven't been reaped yet
+    unsigned inFlight;
+#endif
+#ifndef _WIN32
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SfIoOp *queue[SF_IO_DEPTH];
+    unsigned queueHead;
+    unsigned queueCount;
+    int quit;
+#endif
+} SfIo;
+
+static inline void *SfAlignedAlloc(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, SF_IO_ALIGN);
+#else
+    void *ptr;
+    if (posix_memalign(&ptr, SF_IO_ALIGN, size)) { return NULL; }
+    return ptr;
+#endif
+}
+
+static inline void SfAlignedFree(void *ptr) {
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+static inline int SfOpenRead(const char *path) {
+#ifdef _WIN32
+    return _open(path, _O_RDONLY | _O_BINARY);
+#else
+    return open(path, O_RDONLY);
+#endif
+}
+
+static inline int SfOpenWrite(const char *path) {
+#ifdef _WIN32
+    return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+// opens an existing file for writing in place
+static inline int SfOpenUpdate(const char *path) {
+#ifdef _WIN32
+    return _open(path, _O_RDWR | _O_BINARY);
+#else
+    return open(path, O_RDWR);
+#endif
+}
+
+static inline void SfClose(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+static inline int64_t SfFileSize(int fd) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_fstat64(fd, &st)) { return -1; }
+#else
+    struct stat st;
+    if (fstat(fd, &st)) { return -1; }
+#endif
+    return (int64_t)st.st_size;
+}
+
+// --- read-only file mappings ---
+typedef struct {
+    const uint8_t *data;
+    int64_t size;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} SfMap;
+
+// returns 0 on success, -1 if the file couldn't be opened or mapped
+static inline int SfMapFile(SfMap *map, const char *path) {
+    memset(map, 0, sizeof(*map));
+    int fd = SfOpenRead(path);
+    if (fd < 0) { return -1; }
+    map->size = SfFileSize(fd);
+    if (map->size <= 0) {
+        SfClose(fd);
+        return (map->size == 0) ? 0 : -1;
+    }
+#ifdef _WIN32
+    map->mapping = CreateFileMappingA((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+    SfClose(fd);
+    if (!map->mapping) { return -1; }
+    map->data = (const uint8_t *)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!map->data) {
+        CloseHandle(map->mapping);
+        return -1;
+    }
+#else
+    void *ptr = mmap(NULL, (size_t)map->size, PROT_READ, MAP_SHARED, fd, 0);
+    SfClose(fd);
+    if (ptr == MAP_FAILED) { return -1; }
+    map->data = (const uint8_t *)ptr;
+#endif
+    return 0;
+}
+
+static inline void SfUnmapFile(SfMap *map) {
+    if (!map->data) { return; }
+#ifdef _WIN32
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+#else
+    munmap((void *)map->data, (size_t)map->size);
+#endif
+    map->data = NULL;
+}
+
+// does (the rest of) a transfer synchronously. returns bytes transferred, which
+// is only short for reads that hit the end of the file, or -errno.
+static inline long SfTransfer(int fd, uint8_t *buf, size_t len, int64_t off, int write) {
+    size_t total = 0;
+
+#ifdef _WIN32
+    if (_lseeki64(fd, off, SEEK_SET) < 0) { return -errno; }
+#endif
+    while (total < len) {
+        size_t chunk = len - total;
+#ifdef _WIN32
+        if (chunk > 0x40000000) { chunk = 0x40000000; }
+        int n = write ? _write(fd, buf + total, (unsigned)chunk) : _read(fd, buf + total, (unsigned)chunk);
+#else
+        ssize_t n = write ? pwrite(fd, buf + total, chunk, off + total) : pread(fd, buf + total, chunk, off + total);
+#endif
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            return -errno;
+        }
+        if (n == 0) { break; }
+        total += n;
+    }
+    return (long)total;
+}
+
+#ifdef SF_HAVE_IO_URING
+static inline int SfUringInit(SfIo *io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, SF_IO_DEPTH, &p);
+    if (fd < 0) { return -1; }
+
+    io->ringFd = fd;
+    io->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cqRingSize > io->sqRingSize) { io->sqRingSize = io->cqRingSize; }
+        io->cqRingSize = io->sqRingSize;
+    }
+    io->sqRing = mmap(NULL, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (io->sqRing == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        io->cqRing = io->sqRing;
+    }
+    else {
+        io->cqRing = mmap(NULL, io->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (io->cqRing == MAP_FAILED) {
+            munmap(io->sqRing, io->sqRingSize);
+            close(fd);
+            return -1;
+        }
+    }
+    io->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = (struct io_uring_sqe *)mmap(NULL, io->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED) {
+        if (io->cqRing != io->sqRing) { munmap(io->cqRing, io->cqRingSize); }
+        munmap(io->sqRing, io->sqRingSize);
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *sq = (uint8_t *)io->sqRing;
+    uint8_t *cq = (uint8_t *)io->cqRing;
+    io->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    io->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    io->sqArray = (unsigned *)(sq + p.sq_off.array);
+    io->cqHead = (unsigned *)(cq + p.cq_off.head);
+    io->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    io->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static inline void SfUringShutdown(SfIo *io) {
+    // the rings can't go away while the kernel still owns a transfer. the ops
+    // themselves may be gone by now, so their completions are just skipped.
+    while (io->inFlight) {
+        unsigned head = *io->cqHead;
+        if (head == __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE)) {
+            if ((syscall(__NR_io_uring_enter, io->ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) &&
+                (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+                break;
+            }
+            continue;
+        }
+        __atomic_store_n(io->cqHead, head + 1, __ATOMIC_RELEASE);
+        io->inFlight--;
+    }
+    munmap(io->sqes, io->sqesSize);
+    if (io->cqRing != io->sqRing) { munmap(io->cqRing, io->cqRingSize); }
+    munmap(io->sqRing, io->sqRingSize);
+    close(io->ringFd);
+}
+
+static inline void SfUringSubmit(SfIo *io, SfIoOp *op) {
+    unsigned tail = *io->sqTail;
+    unsigned index = tail & *io->sqMask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = op->fd;
+    sqe->addr = (uint64_t)(uintptr_t)op->buf;
+    sqe->len = (uint32_t)op->len;
+    sqe->off = (uint64_t)op->off;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    io->sqArray[index] = index;
+    __atomic_store_n(io->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, io->ringFd, 1, 0, 0, NULL, 0) < 0) {
+        if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) { abort(); }
+    }
+    io->inFlight++;
+}
+
+static inline void SfUringWait(SfIo *io, SfIoOp *op) {
+    while (!op->done) {
+        unsigned head = *io->cqHead;
+        if (head == __atomic_load_n(io->cqTail, __ATOMIC_ACQUIRE)) {
+            if ((syscall(__NR_io_uring_enter, io->ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) &&
+                (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+                // the ring is broken, fail the transfer instead of spinning
+                op->result = -errno;
+                op->done = 1;
+                return;
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cqMask];
+        SfIoOp *finished = (SfIoOp *)(uintptr_t)cqe->user_data;
+        long res = cqe->res;
+        __atomic_store_n(io->cqHead, head + 1, __ATOMIC_RELEASE);
+        io->inFlight--;
+
+        if (res == -EINVAL || res == -EOPNOTSUPP) {
+            // pre-5.6 kernels don't have IORING_OP_READ/WRITE
+            res = SfTransfer(finished->fd, finished->buf, finished->len, finished->off, finished->write);
+        }
+        else if ((res > 0) && ((size_t)res < finished->len)) {
+            // short transfer, finish it synchronously
+            long rest = SfTransfer(finished->fd, finished->buf + res, finished->len - res, finished->off + res, finished->write);
+            res = (rest < 0) ? rest : res + rest;
+        }
+        finished->result = res;
+        finished->done = 1;
+    }
+}
+#endif
+
+#ifndef _WIN32
+static inline void *SfWorker(void *arg) {
+    SfIo *io = (SfIo *)arg;
+
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->queueCount && !io->quit) {
+            pthread_cond_wait(&io->cond, &io->lock);
+        }
+        if (!io->queueCount) { break; }
+
+        SfIoOp *op = io->queue[io->queueHead];
+        io->queueHead = (io->queueHead + 1) % SF_IO_DEPTH;
+        io->queueCount--;
+        pthread_mutex_unlock(&io->lock);
+
+        long result = SfTransfer(op->fd, op->buf, op->len, op->off, op->write);
+
+        pthread_mutex_lock(&io->lock);
+        op->result = result;
+        op->done = 1;
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+#endif
+
+static inline void SfIoInit(SfIo *io) {
+    memset(io, 0, sizeof(*io));
+#ifdef SF_HAVE_IO_URING
+    if (!SfUringInit(io)) {
+        io->backend = SF_BACKEND_URING;
+        return;
+    }
+#endif
+#ifndef _WIN32
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+    if (!pthread_create(&io->thread, NULL, SfWorker, io)) {
+        io->backend = SF_BACKEND_THREAD;
+        return;
+    }
+    pthread_cond_destroy(&io->cond);
+    pthread_mutex_destroy(&io->lock);
+#endif
+    io->backend = SF_BACKEND_SYNC;
+}
+
+// waits for the outstanding transfers to finish first
+static inline void SfIoShutdown(SfIo *io) {
+#ifdef SF_HAVE_IO_URING
+    if (io->backend == SF_BACKEND_URING) {
+        SfUringShutdown(io);
+        return;
+    }
+#endif
+#ifndef _WIN32
+    if (io->backend == SF_BACKEND_THREAD) {
+        pthread_mutex_lock(&io->lock);
+        io->quit = 1;
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+        pthread_join(io->thread, NULL);
+        pthread_cond_destroy(&io->cond);
+        pthread_mutex_destroy(&io->lock);
+    }
+#endif
+}
+
+static inline const char *SfIoBackendName(SfIo *io) {
+    switch (io->backend) {
+    case SF_BACKEND_URING: return "io_uring";
+    case SF_BACKEND_THREAD: return "thread";
+    default: return "sync";
+    }
+}
+
+// queues a transfer. the caller must keep no more than SF_IO_DEPTH transfers
+// in flight and must not touch op or its buffer until SfIoWait returns.
+static inline void SfIoSubmit(SfIo *io, SfIoOp *op) {
+    op->done = 0;
+    op->result = 0;
+#ifdef SF_HAVE_IO_URING
+    if (io->backend == SF_BACKEND_URING) {
+        SfUringSubmit(io, op);
+        return;
+    }
+#endif
+#ifndef _WIN32
+    if (io->backend == SF_BACKEND_THREAD) {
+        pthread_mutex_lock(&io->lock);
+        while (io->queueCount == SF_IO_DEPTH) {
+            pthread_cond_wait(&io->cond, &io->lock);
+        }
+        io->queue[(io->queueHead + io->queueCount) % SF_IO_DEPTH] = op;
+        io->queueCount++;
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+        return;
+    }
+#endif
+    op->result = SfTransfer(op->fd, op->buf, op->len, op->off, op->write);
+    op->done = 1;
+}
+
+// blocks until op is finished and returns its result
+static inline long SfIoWait(SfIo *io, SfIoOp *op) {
+#ifdef SF_HAVE_IO_URING
+    if (io->backend == SF_BACKEND_URING) {
+        SfUringWait(io, op);
+        return op->result;
+    }
+#endif
+#ifndef _WIN32
+    if (io->backend == SF_BACKEND_THREAD) {
+        pthread_mutex_lock(&io->lock);
+        while (!op->done) {
+            pthread_cond_wait(&io->cond, &io->lock);
+        }
+        pthread_mutex_unlock(&io->lock);
+    }
+#endif
+    return op->result;
+}
+
+// --- sequential reader ---
+// Keeps two block reads in flight/ready: while the caller consumes one block,
+// the next one is being read into the other buffer.
+typedef struct {
+    SfIo *io;
+    int fd;
+    int64_t fileSize;
+    int64_t nextOff;
+    uint8_t *buf[2];
+    SfIoOp op[2];
+    int pending[2];
+    int cur;
+    size_t pos;
+    size_t avail;
+    // set if a read failed, SfRead stops short as if it hit the end of the file
+    int error;
+} SfReader;
+
+static inline void SfReaderFill(SfReader *r, int i) {
+    if (r->nextOff >= r->fileSize) { return; }
+    r->op[i].fd = r->fd;
+    r->op[i].buf = r->buf[i];
+    r->op[i].len = SF_IO_BLOCK;
+    r->op[i].off = r->nextOff;
+    r->op[i].write = 0;
+    r->nextOff += SF_IO_BLOCK;
+    SfIoSubmit(r->io, &r->op[i]);
+    r->pending[i] = 1;
+}
+
+// swaps to the other buffer, returns 0 at the end of the file
+static inline int SfReaderAdvance(SfReader *r) {
+    SfReaderFill(r, r->cur);
+    r->cur ^= 1;
+    r->pos = 0;
+    r->avail = 0;
+    if (!r->pending[r->cur]) { return 0; }
+    long result = SfIoWait(r->io, &r->op[r->cur]);
+    r->pending[r->cur] = 0;
+    if (result > 0) { r->avail = result; }
+    else if (result < 0) { r->error = 1; }
+    return r->avail != 0;
+}
+
+// returns 0 on success, -1 if the file couldn't be opened
+static inline int SfReaderOpen(SfReader *r, SfIo *io, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->io = io;
+    r->fd = SfOpenRead(path);
+    if (r->fd < 0) { return -1; }
+    r->fileSize = SfFileSize(r->fd);
+    r->buf[0] = (uint8_t *)SfAlignedAlloc(SF_IO_BLOCK);
+    r->buf[1] = (uint8_t *)SfAlignedAlloc(SF_IO_BLOCK);
+    if (!r->buf[0] || !r->buf[1]) { abort(); }
+
+    // cur starts out "used up" so the first SfRead kicks off both buffers
+    r->cur = 1;
+    SfReaderFill(r, 0);
+    return 0;
+}
+
+// returns the number of bytes copied to dest, short only at the end of the file
+static inline size_t SfRead(SfReader *r, void *dest, size_t len) {
+    uint8_t *out = (uint8_t *)dest;
+    size_t copied = 0;
+
+    while (copied < len) {
+        if (r->pos == r->avail) {
+            if (!SfReaderAdvance(r)) { break; }
+        }
+        size_t n = r->avail - r->pos;
+        if (n > len - copied) { n = len - copied; }
+        memcpy(out + copied, r->buf[r->cur] + r->pos, n);
+        r->pos += n;
+        copied += n;
+    }
+    return copied;
+}
+
+static inline void SfReaderClose(SfReader *r) {
+    for (int i = 0; i < 2; i++) {
+        if (r->pending[i]) { SfIoWait(r->io, &r->op[i]); }
+        SfAlignedFree(r->buf[i]);
+    }
+    SfClose(r->fd);
+}
+
+// --- sequential writer ---
+// Data is collected into one buffer while the previous one is being written out.
+typedef struct {
+    SfIo *io;
+    int fd;
+    int64_t off;
+    uint8_t *buf[2];
+    SfIoOp op[2];
+    int pending[2];
+    int cur;
+    size_t fill;
+    int error;
+} SfWriter;
+
+static inline void SfWriterCheck(SfWriter *w, int i) {
+    if (!w->pending[i]) { return; }
+    if (SfIoWait(w->io, &w->op[i]) != (long)w->op[i].len) { w->error = 1; }
+    w->pending[i] = 0;
+}
+
+static inline void SfWriterFlush(SfWriter *w) {
+    if (!w->fill) { return; }
+    SfIoOp *op = &w->op[w->cur];
+    op->fd = w->fd;
+    op->buf = w->buf[w->cur];
+    op->len = w->fill;
+    op->off = w->off;
+    op->write = 1;
+    w->off += w->fill;
+    SfIoSubmit(w->io, op);
+    w->pending[w->cur] = 1;
+
+    w->cur ^= 1;
+    w->fill = 0;
+    SfWriterCheck(w, w->cur);
+}
+
+// returns 0 on success, -1 if the file couldn't be created
+static inline int SfWriterOpen(SfWriter *w, SfIo *io, const char *path) {
+    memset(w, 0, sizeof(*w));
+    w->io = io;
+    w->fd = SfOpenWrite(path);
+    if (w->fd < 0) { return -1; }
+    w->buf[0] = (uint8_t *)SfAlignedAlloc(SF_IO_BLOCK);
+    w->buf[1] = (uint8_t *)SfAlignedAlloc(SF_IO_BLOCK);
+    if (!w->buf[0] || !w->buf[1]) { abort(); }
+    return 0;
+}
+
+static inline void SfWrite(SfWriter *w, const void *src, size_t len) {
+    const uint8_t *in = (const uint8_t *)src;
+
+    while (len) {
+        size_t n = SF_IO_BLOCK - w->fill;
+        if (n > len) { n = len; }
+        memcpy(w->buf[w->cur] + w->fill, in, n);
+        w->fill += n;
+        in += n;
+        len -= n;
+        if (w->fill == SF_IO_BLOCK) { SfWriterFlush(w); }
+    }
+}
+
+// returns 0 if everything made it to the file, -1 otherwise
+static inline int SfWriterClose(SfWriter *w) {
+    SfWriterFlush(w);
+    for (int i = 0; i < 2; i++) {
+        SfWriterCheck(w, i);
+        SfAlignedFree(w->buf[i]);
+    }
+    SfClose(w->fd);
+    return w->error ? -1 : 0;
+}
+
+#endif